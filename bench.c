@@ -0,0 +1,161 @@
+// include other header files as needed
+#include <time.h>
+#include "mems1.h"
+
+#define BENCH_NODES 64
+#define BENCH_BLOCK 16
+#define BENCH_ITERATIONS 2000
+
+double elapsed_ns(struct timespec start, struct timespec end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+// fills BENCH_NODES chain nodes completely with small PROCESS segments, none of them keeps a HOLE
+void fill_nodes(void **ptr, size_t total_blocks)
+{
+    for (size_t i = 0; i < total_blocks; i++)
+    {
+        ptr[i] = mems_malloc(BENCH_BLOCK);
+    }
+}
+
+/*
+Segment walk: free one block in the last node and allocate it again.
+mems_malloc has to get past every earlier node before it reaches the only
+HOLE, and mems_free has to locate and coalesce the block.
+*/
+void bench_segment_walk(void **ptr, size_t blocks_per_node, size_t total_blocks)
+{
+    struct timespec start, end;
+    double free_ns = 0;
+    double malloc_ns = 0;
+    size_t victim = total_blocks - blocks_per_node / 2;
+
+    mems_init();
+    fill_nodes(ptr, total_blocks);
+    for (int i = 0; i < BENCH_ITERATIONS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mems_free(ptr[victim]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free_ns += elapsed_ns(start, end);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ptr[victim] = mems_malloc(BENCH_BLOCK);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        malloc_ns += elapsed_ns(start, end);
+    }
+    mems_finish();
+
+    printf("------- Segment walk [%d nodes x %lu segments] -------\n", BENCH_NODES, blocks_per_node);
+    printf("mems_free:   %10.1f ns/op\n", free_ns / BENCH_ITERATIONS);
+    printf("mems_malloc: %10.1f ns/op\n", malloc_ns / BENCH_ITERATIONS);
+}
+
+/*
+Free latency: free every other block of the filled nodes, once with holes
+merged inline and once with defer_free, where the application runs
+mems_maintain itself every BENCH_MAINTAIN_EVERY frees outside the timed region.
+*/
+#define BENCH_MAINTAIN_EVERY 512
+
+double bench_free_latency(void **ptr, size_t total_blocks, int defer_free)
+{
+    struct timespec start, end;
+    double free_ns = 0;
+    size_t frees = 0;
+    memsConfig config = {.defer_free = defer_free};
+
+    mems_init_config(&config);
+    fill_nodes(ptr, total_blocks);
+    for (size_t i = 0; i < total_blocks; i += 2)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mems_free(ptr[i]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free_ns += elapsed_ns(start, end);
+
+        frees++;
+        if (frees % BENCH_MAINTAIN_EVERY == 0)
+        {
+            mems_maintain();
+        }
+    }
+    mems_finish();
+    return free_ns / frees;
+}
+
+/*
+Cache coloring: allocate objects a little over half a page, so every object gets
+its own chain node and leaves enough slack for 32 colors, then keep reading the
+first cache line of every object. Without coloring all of those lines share the
+same page offset and therefore the same cache sets.
+*/
+#define BENCH_TRAVERSALS 2000
+#define BENCH_OBJECT (PAGE_SIZE / 2 + CACHE_LINE_SIZE)
+
+size_t pages_used()
+{
+    size_t pages = 0;
+    for (chainNode *temp = head; temp != NULL; temp = temp->next)
+    {
+        pages = pages + temp->seg_size / PAGE_SIZE;
+    }
+    return pages;
+}
+
+double bench_coloring(void **ptr, size_t objects, unsigned int cache_colors, size_t *pages)
+{
+    struct timespec start, end;
+    memsConfig config = {.cache_colors = cache_colors};
+    volatile size_t sink = 0;
+
+    mems_init_config(&config);
+    for (size_t i = 0; i < objects; i++)
+    {
+        ptr[i] = mems_get(mems_malloc(BENCH_OBJECT));
+        *(size_t *)ptr[i] = i;
+    }
+    *pages = pages_used();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int round = 0; round < BENCH_TRAVERSALS; round++)
+    {
+        size_t sum = 0;
+        for (size_t i = 0; i < objects; i++)
+        {
+            sum += *(size_t *)ptr[i];
+        }
+        sink += sum;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    mems_finish();
+    return elapsed_ns(start, end) / ((double)BENCH_TRAVERSALS * objects);
+}
+
+int main(int argc, char const *argv[])
+{
+    size_t blocks_per_node = PAGE_SIZE / BENCH_BLOCK;
+    size_t total_blocks = BENCH_NODES * blocks_per_node;
+    void **ptr = (void **)allocate_memory_mmap(sizeof(void *) * total_blocks);
+
+    bench_segment_walk(ptr, blocks_per_node, total_blocks);
+
+    printf("------- Free latency [%lu frees] -------\n", total_blocks / 2);
+    printf("inline:   %10.1f ns/op\n", bench_free_latency(ptr, total_blocks, 0));
+    printf("deferred: %10.1f ns/op\n", bench_free_latency(ptr, total_blocks, 1));
+
+    printf("------- Object traversal across nodes -------\n");
+    for (size_t objects = 256; objects <= 1024; objects *= 2)
+    {
+        size_t off_pages, on_pages;
+        double off = bench_coloring(ptr, objects, 0, &off_pages);
+        double on = bench_coloring(ptr, objects, PAGE_SIZE / CACHE_LINE_SIZE, &on_pages);
+        printf("%4lu nodes: coloring off %6.2f ns/object (%lu pages), on %6.2f ns/object (%lu pages)\n", objects, off, off_pages, on, on_pages);
+    }
+
+    deallocate_memory_munmap(ptr, sizeof(void *) * total_blocks);
+    return 0;
+}
@@ -12,7 +12,16 @@ REFER DOCUMENTATION FOR MORE DETAILS ON FUNCTIONS AND THEIR FUNCTIONALITY
 // add other headers as required
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
 Use this macro where ever you need PAGE_SIZE.
@@ -21,10 +30,33 @@ macro to make the output of all system same and conduct a fair evaluation.
 */
 #define PAGE_SIZE 4096
 #define MAP_ANONYMOUS 0x20
+#define CACHE_LINE_SIZE 64
 
 struct chainNode *head;
 size_t virtualAddressStart;
 
+/*
+Optional settings passed to mems_init_config. mems_init uses all zeroes.
+defer_free: mems_free only queues the pointer, holes are merged later by mems_maintain.
+maintenance_interval_ms: when non zero a background thread calls mems_maintain at this cadence.
+cache_colors: when above one, the first allocation of each new chain node starts at a rotating
+multiple of CACHE_LINE_SIZE so objects from different nodes land in different cache sets.
+The offset is taken from the slack the node has after rounding up to whole pages, so coloring
+never maps extra pages; allocations that fill their pages exactly are not colored.
+*/
+typedef struct memsConfig
+{
+    int defer_free;
+    unsigned int maintenance_interval_ms;
+    unsigned int cache_colors;
+} memsConfig;
+
+memsConfig memsSettings;
+size_t next_cache_color;
+
+// guards the main chain and every segment table once a maintenance thread may be running
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void *allocate_memory_mmap(size_t size)
 {
     void *alloted_memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -45,34 +77,27 @@ void *deallocate_memory_munmap(void *alloted_memory, size_t size)
     }
 }
 
-typedef struct subChainNode
-{
-    struct subChainNode *next;
-    struct subChainNode *prev;
-    int type;
-
-    size_t v_ptr_start_index;
-    size_t chunk_size;
-} subChainNode;
-
-// constructor
-subChainNode *createSubChainNode(int type, size_t size, size_t v_ptr_start_index)
-{
-    subChainNode *newNode = (subChainNode *)allocate_memory_mmap(sizeof(subChainNode));
-    newNode->next = NULL;
-    newNode->prev = NULL;
-    newNode->type = type;
-
-    newNode->chunk_size = size;
-    newNode->v_ptr_start_index = v_ptr_start_index;
-    return newNode;
-}
+/*
+The sub-chain of every chain node is kept as a segment table: one contiguous
+mapping holding the offsets, sizes and types of all segments as parallel arrays,
+sorted by offset. Walking the sub-chain is then a scan over dense memory.
+*/
+#define SUB_CHAIN_INITIAL_CAPACITY (PAGE_SIZE / (2 * sizeof(size_t) + 1))
 
 typedef struct chainNode
 {
     struct chainNode *next;
     struct chainNode *prev;
-    struct subChainNode *subChainHead;
+
+    size_t *sub_offset;
+    size_t *sub_size;
+    unsigned char *sub_type; // 0 for process, 1 for hole
+    size_t sub_count;
+    size_t sub_capacity;
+
+    size_t max_hole; // never smaller than the largest hole, lets mems_malloc skip the node
+    int dirty;       // holes changed since the last mems_maintain
+    int unmerged;    // holes marked by a queued free that are not merged yet
 
     size_t seg_size;
     size_t v_ptr_start;
@@ -82,12 +107,65 @@ typedef struct chainNode
     void *store_v_to_free;
 } chainNode;
 
+size_t sub_chain_bytes(size_t capacity)
+{
+    return capacity * (2 * sizeof(size_t) + 1);
+}
+
+void allocate_sub_chain(chainNode *node, size_t capacity)
+{
+    void *table = allocate_memory_mmap(sub_chain_bytes(capacity));
+    node->sub_offset = (size_t *)table;
+    node->sub_size = node->sub_offset + capacity;
+    node->sub_type = (unsigned char *)(node->sub_size + capacity);
+    node->sub_capacity = capacity;
+}
+
+void grow_sub_chain(chainNode *node)
+{
+    size_t *old_offset = node->sub_offset;
+    size_t *old_size = node->sub_size;
+    unsigned char *old_type = node->sub_type;
+    size_t old_capacity = node->sub_capacity;
+
+    allocate_sub_chain(node, old_capacity * 2);
+    memcpy(node->sub_offset, old_offset, sizeof(size_t) * node->sub_count);
+    memcpy(node->sub_size, old_size, sizeof(size_t) * node->sub_count);
+    memcpy(node->sub_type, old_type, node->sub_count);
+
+    deallocate_memory_munmap(old_offset, sub_chain_bytes(old_capacity));
+}
+
+// inserts a segment at position i of the table, shifting the later ones up
+void insert_sub_chain(chainNode *node, size_t i, int type, size_t offset, size_t size)
+{
+    if (node->sub_count == node->sub_capacity)
+    {
+        grow_sub_chain(node);
+    }
+
+    size_t after = node->sub_count - i;
+    memmove(node->sub_offset + i + 1, node->sub_offset + i, sizeof(size_t) * after);
+    memmove(node->sub_size + i + 1, node->sub_size + i, sizeof(size_t) * after);
+    memmove(node->sub_type + i + 1, node->sub_type + i, after);
+
+    node->sub_offset[i] = offset;
+    node->sub_size[i] = size;
+    node->sub_type[i] = type;
+    node->sub_count++;
+}
+
 chainNode *createChainNode(size_t seg_size)
 {
     chainNode *newNode = (chainNode *)allocate_memory_mmap(sizeof(chainNode));
     newNode->next = NULL;
     newNode->prev = NULL;
-    newNode->subChainHead = NULL;
+
+    allocate_sub_chain(newNode, SUB_CHAIN_INITIAL_CAPACITY);
+    newNode->sub_count = 0;
+    newNode->max_hole = 0;
+    newNode->dirty = 0;
+    newNode->unmerged = 0;
 
     newNode->seg_size = seg_size;
     newNode->v_ptr_start = virtualAddressStart;
@@ -105,6 +183,163 @@ chainNode *createChainNode(size_t seg_size)
     return newNode;
 }
 
+/*
+Frees waiting for mems_maintain are kept in a bounded lock-free ring so that
+mems_free never blocks on heap_lock. Every slot carries a sequence number telling
+producers whether it is free to write and the consumer whether it has been filled.
+*/
+#define DEFERRED_QUEUE_CAPACITY 1024
+
+typedef struct deferredFree
+{
+    atomic_size_t sequence;
+    void *v_ptr;
+} deferredFree;
+
+deferredFree *deferred_queue;
+atomic_size_t deferred_tail;
+size_t deferred_head; // only touched with heap_lock held
+
+pthread_t maintenance_thread;
+pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t maintenance_wakeup = PTHREAD_COND_INITIALIZER;
+int maintenance_running;
+int maintenance_stop;
+
+// returns 0 when the queue is full and the caller has to free inline
+int push_deferred_free(void *v_ptr)
+{
+    size_t pos = atomic_load_explicit(&deferred_tail, memory_order_relaxed);
+    while (1)
+    {
+        deferredFree *slot = &deferred_queue[pos % DEFERRED_QUEUE_CAPACITY];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&deferred_tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                slot->v_ptr = v_ptr;
+                atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&deferred_tail, memory_order_relaxed);
+        }
+    }
+}
+
+// returns NULL when the queue is empty, must be called with heap_lock held
+void *pop_deferred_free()
+{
+    deferredFree *slot = &deferred_queue[deferred_head % DEFERRED_QUEUE_CAPACITY];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != deferred_head + 1)
+    {
+        return NULL;
+    }
+    void *v_ptr = slot->v_ptr;
+    atomic_store_explicit(&slot->sequence, deferred_head + DEFERRED_QUEUE_CAPACITY, memory_order_release);
+    deferred_head++;
+    return v_ptr;
+}
+
+void mems_maintain();
+
+void *maintenance_loop(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&maintenance_lock);
+    while (!maintenance_stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += memsSettings.maintenance_interval_ms / 1000;
+        deadline.tv_nsec += (long)(memsSettings.maintenance_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&maintenance_wakeup, &maintenance_lock, &deadline);
+        if (maintenance_stop)
+        {
+            break;
+        }
+
+        pthread_mutex_unlock(&maintenance_lock);
+        mems_maintain();
+        pthread_mutex_lock(&maintenance_lock);
+    }
+    pthread_mutex_unlock(&maintenance_lock);
+    return NULL;
+}
+
+void stop_maintenance_thread()
+{
+    if (!maintenance_running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&maintenance_lock);
+    maintenance_stop = 1;
+    pthread_cond_signal(&maintenance_wakeup);
+    pthread_mutex_unlock(&maintenance_lock);
+    pthread_join(maintenance_thread, NULL);
+    maintenance_running = 0;
+}
+
+/*
+Same as mems_init but with the optional settings described at memsConfig.
+When defer_free is set the deferred free queue is mapped, and when
+maintenance_interval_ms is non zero the background maintenance thread is started.
+Input Parameter: the settings to use
+Returns: Nothing
+*/
+void mems_init_config(const memsConfig *config)
+{
+    head = NULL;
+    virtualAddressStart = 1000;
+    memsSettings = *config;
+
+    // the allocator only controls the offset inside a page, the higher set bits of the larger
+    // caches come from the physical frame the OS picks, so more colors than lines per page never help
+    if (memsSettings.cache_colors > PAGE_SIZE / CACHE_LINE_SIZE)
+    {
+        memsSettings.cache_colors = PAGE_SIZE / CACHE_LINE_SIZE;
+    }
+    next_cache_color = 0;
+
+    deferred_queue = NULL;
+    if (memsSettings.defer_free)
+    {
+        deferred_queue = (deferredFree *)allocate_memory_mmap(sizeof(deferredFree) * DEFERRED_QUEUE_CAPACITY);
+        for (size_t i = 0; i < DEFERRED_QUEUE_CAPACITY; i++)
+        {
+            atomic_init(&deferred_queue[i].sequence, i);
+        }
+        atomic_init(&deferred_tail, 0);
+        deferred_head = 0;
+    }
+
+    maintenance_running = 0;
+    maintenance_stop = 0;
+    if (memsSettings.maintenance_interval_ms > 0)
+    {
+        if (pthread_create(&maintenance_thread, NULL, maintenance_loop, NULL) != 0)
+        {
+            perror("Error while starting the maintenance thread\n");
+            exit(EXIT_FAILURE);
+        }
+        maintenance_running = 1;
+    }
+}
+
 /*
 Initializes all the required parameters for the MeMS system. The main parameters to be initialized are:
 1. the head of the free list i.e. the pointer that points to the head of the free list
@@ -115,8 +350,8 @@ Returns: Nothing
 */
 void mems_init()
 {
-    head = NULL;
-    virtualAddressStart = 1000;
+    memsConfig config = {.defer_free = 0, .maintenance_interval_ms = 0, .cache_colors = 0};
+    mems_init_config(&config);
 }
 
 /*
@@ -127,21 +362,18 @@ Returns: Nothing
 */
 void mems_finish()
 {
-    for (chainNode *temp = head; temp != NULL;)
+    stop_maintenance_thread();
+    if (deferred_queue != NULL)
     {
-        for (subChainNode *subTemp = temp->subChainHead; subTemp != NULL;)
-        {
-            subChainNode *to_delete = subTemp;
-            subTemp = subTemp->next;
-
-            to_delete->next = NULL;
-            to_delete->prev = NULL;
-            deallocate_memory_munmap(to_delete, sizeof(subChainNode));
-        }
+        deallocate_memory_munmap(deferred_queue, sizeof(deferredFree) * DEFERRED_QUEUE_CAPACITY);
+    }
 
+    for (chainNode *temp = head; temp != NULL;)
+    {
         chainNode *to_delete_main = temp;
         temp = temp->next;
 
+        deallocate_memory_munmap(to_delete_main->sub_offset, sub_chain_bytes(to_delete_main->sub_capacity));
         deallocate_memory_munmap(to_delete_main->p_ptr, to_delete_main->seg_size);
         deallocate_memory_munmap(to_delete_main->store_v_to_free, to_delete_main->seg_size);
         deallocate_memory_munmap(to_delete_main, sizeof(chainNode));
@@ -149,25 +381,223 @@ void mems_finish()
     mems_init();
 }
 
-void split_subChainNode(subChainNode *node, size_t size, size_t index)
+// shrinks segment i to size and inserts the remainder right after it as a hole
+void split_subChainNode(chainNode *node, size_t i, size_t size)
+{
+    if (node->sub_size[i] == size)
+    {
+        return;
+    }
+
+    insert_sub_chain(node, i + 1, 1, node->sub_offset[i] + size, node->sub_size[i] - size);
+    node->sub_size[i] = size;
+    if (node->sub_size[i + 1] > node->max_hole)
+    {
+        node->max_hole = node->sub_size[i + 1];
+    }
+}
+
+/*
+Returns the index of the first hole in the node that can hold size bytes, or
+sub_count if there is none. With SSE2 the type bytes are compared sixteen at a
+time and only the sizes of the holes found that way are checked; the remaining
+entries, or all of them without SSE2, are checked one by one.
+*/
+size_t find_hole(chainNode *node, size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i hole = _mm_set1_epi8(1);
+    for (; i + 16 <= node->sub_count; i += 16)
+    {
+        __m128i types = _mm_loadu_si128((const __m128i *)(node->sub_type + i));
+        unsigned int holes = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(types, hole));
+        while (holes != 0)
+        {
+            size_t k = i + __builtin_ctz(holes);
+            if (node->sub_size[k] >= size)
+            {
+                return k;
+            }
+            holes &= holes - 1;
+        }
+    }
+#endif
+    for (; i < node->sub_count; i++)
+    {
+        if (node->sub_type[i] == 1 && node->sub_size[i] >= size)
+        {
+            return i;
+        }
+    }
+    return node->sub_count;
+}
+
+// binary search for the segment starting at offset, returns sub_count if there is none
+size_t find_segment(chainNode *node, size_t offset)
 {
-    if (node->chunk_size == size)
+    size_t low = 0;
+    size_t high = node->sub_count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (node->sub_offset[mid] < offset)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low < node->sub_count && node->sub_offset[low] == offset)
+    {
+        return low;
+    }
+    return node->sub_count;
+}
+
+// merges runs of adjacent holes in one pass, compacting the table in place
+void fragment_memory(chainNode *node)
+{
+    if (node->sub_count == 0)
     {
         return;
     }
 
-    subChainNode *newNode = createSubChainNode(1, node->chunk_size - size, index);
+    size_t last = 0;
+    size_t max_hole = 0;
+    for (size_t i = 1; i < node->sub_count; i++)
+    {
+        if (node->sub_type[last] == 1 && node->sub_type[i] == 1)
+        {
+            node->sub_size[last] = node->sub_size[last] + node->sub_size[i];
+            continue;
+        }
+        if (node->sub_type[last] == 1 && node->sub_size[last] > max_hole)
+        {
+            max_hole = node->sub_size[last];
+        }
+        last++;
+        node->sub_offset[last] = node->sub_offset[i];
+        node->sub_size[last] = node->sub_size[i];
+        node->sub_type[last] = node->sub_type[i];
+    }
+    if (node->sub_type[last] == 1 && node->sub_size[last] > max_hole)
+    {
+        max_hole = node->sub_size[last];
+    }
+    node->sub_count = last + 1;
+    node->max_hole = max_hole;
+}
+
+// marks the segment starting at v_ptr as a hole, merge coalesces its node right away
+void release_segment(void *v_ptr, int merge)
+{
+    for (chainNode *temp = head; temp != NULL; temp = temp->next)
+    {
+        if (temp->v_ptr <= v_ptr && v_ptr < temp->v_ptr + temp->seg_size)
+        {
+            size_t i = find_segment(temp, (size_t)v_ptr - (size_t)temp->v_ptr);
+            if (i < temp->sub_count)
+            {
+                temp->sub_type[i] = 1;
+                temp->dirty = 1;
+                if (temp->sub_size[i] > temp->max_hole)
+                {
+                    temp->max_hole = temp->sub_size[i];
+                }
+                if (merge)
+                {
+                    fragment_memory(temp);
+                }
+                else
+                {
+                    temp->unmerged = 1;
+                }
+            }
+            break;
+        }
+    }
+}
+
+/*
+Applies every queued free and returns how many there were. The holes are marked
+first and each node they touched is merged once afterwards, so a long queue
+costs one fragment_memory pass per node instead of one per free.
+Must be called with heap_lock held.
+*/
+size_t drain_deferred_frees()
+{
+    if (deferred_queue == NULL)
+    {
+        return 0;
+    }
+
+    size_t drained = 0;
+    for (void *v_ptr = pop_deferred_free(); v_ptr != NULL; v_ptr = pop_deferred_free())
+    {
+        release_segment(v_ptr, 0);
+        drained++;
+    }
+    if (drained > 0)
+    {
+        for (chainNode *temp = head; temp != NULL; temp = temp->next)
+        {
+            if (temp->unmerged)
+            {
+                fragment_memory(temp);
+                temp->unmerged = 0;
+            }
+        }
+    }
+    return drained;
+}
 
-    newNode->next = node->next;
-    if (node->next != NULL)
+// hands the whole pages inside every hole of the node back to the OS
+void purge_holes(chainNode *node)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < node->sub_count; i++)
     {
-        node->next->prev = newNode;
+        if (node->sub_type[i] != 1)
+        {
+            continue;
+        }
+        size_t start = (node->sub_offset[i] + page - 1) / page * page;
+        size_t end = (node->sub_offset[i] + node->sub_size[i]) / page * page;
+        if (end > start)
+        {
+            // the pages read back as zeroes when they are reused, failure only means nothing was released
+            madvise(node->p_ptr + start, end - start, MADV_DONTNEED);
+        }
     }
+}
 
-    node->next = newNode;
-    newNode->prev = node;
-    node->chunk_size = size;
+// takes size bytes from the first hole that fits, returns NULL if no node has one
+void *reuse_hole(size_t size)
+{
+    for (chainNode *temp = head; temp != NULL; temp = temp->next)
+    {
+        if (temp->max_hole < size)
+        {
+            continue;
+        }
+
+        size_t i = find_hole(temp, size);
+        if (i < temp->sub_count)
+        {
+            split_subChainNode(temp, i, size);
+
+            temp->sub_type[i] = 0;
+            return temp->v_ptr + temp->sub_offset[i];
+        }
+        // every hole in this node is smaller than size
+        temp->max_hole = size > 0 ? size - 1 : 0;
+    }
+    return NULL;
 }
+
 /*
 Allocates memory of the specified size by reusing a segment from the free list if
 a sufficiently large segment is available.
@@ -182,45 +612,63 @@ Returns: MeMS Virtual address (that is created by MeMS)
 */
 void *mems_malloc(size_t size)
 {
-    size_t newNodesize = ((size + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
-    if (head == NULL)
+    pthread_mutex_lock(&heap_lock);
+
+    void *v_ptr = reuse_hole(size);
+    if (v_ptr == NULL && drain_deferred_frees() > 0)
     {
-        head = createChainNode(newNodesize);
-        head->subChainHead = createSubChainNode(0, newNodesize, 0);
-        split_subChainNode(head->subChainHead, size, size);
-        return head->v_ptr;
+        // frees still waiting in the queue may have left a hole that fits
+        v_ptr = reuse_hole(size);
     }
 
-    chainNode *temp = head;
-    chainNode *last = NULL;
-    while (temp != NULL)
+    if (v_ptr == NULL)
     {
-        size_t index = 0;
-        subChainNode *subTemp = temp->subChainHead;
-        while (subTemp != NULL)
+        // the color comes out of the slack left by rounding up to pages, the bytes skipped
+        // for it stay in front of the allocation as a hole
+        size_t newNodesize = ((size + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+        size_t color = 0;
+        if (memsSettings.cache_colors > 1)
         {
-            if (subTemp->type == 1 && subTemp->chunk_size >= size)
+            size_t colors = (newNodesize - size) / CACHE_LINE_SIZE + 1;
+            if (colors > memsSettings.cache_colors)
             {
-                index = index + size;
-                split_subChainNode(subTemp, size, index);
+                colors = memsSettings.cache_colors;
+            }
+            color = (next_cache_color % colors) * CACHE_LINE_SIZE;
+            next_cache_color++;
+        }
 
-                subTemp->type = 0;
-                return temp->v_ptr + subTemp->v_ptr_start_index;
+        chainNode *newNode = createChainNode(newNodesize);
+        insert_sub_chain(newNode, 0, 0, color, newNodesize - color);
+        split_subChainNode(newNode, 0, size);
+        if (color > 0)
+        {
+            insert_sub_chain(newNode, 0, 1, 0, color);
+            if (color > newNode->max_hole)
+            {
+                newNode->max_hole = color;
             }
-            index = index + subTemp->chunk_size;
-            subTemp = subTemp->next;
         }
-        last = temp;
-        temp = temp->next;
-    }
 
-    chainNode *newNode = createChainNode(newNodesize);
-    newNode->subChainHead = createSubChainNode(0, newNodesize, 0);
-    split_subChainNode(newNode->subChainHead, size, size);
+        if (head == NULL)
+        {
+            head = newNode;
+        }
+        else
+        {
+            chainNode *last = head;
+            while (last->next != NULL)
+            {
+                last = last->next;
+            }
+            last->next = newNode;
+            newNode->prev = last;
+        }
+        v_ptr = newNode->v_ptr + color;
+    }
 
-    last->next = newNode;
-    newNode->prev = last;
-    return newNode->v_ptr;
+    pthread_mutex_unlock(&heap_lock);
+    return v_ptr;
 }
 
 /*
@@ -233,6 +681,9 @@ Returns: Nothing but should print the necessary information on STDOUT
 */
 void mems_print_stats()
 {
+    pthread_mutex_lock(&heap_lock);
+    // queued frees are applied first so the stats show the blocks as holes
+    drain_deferred_frees();
     printf("----- MeMS SYSTEM STATS -----\n");
     size_t main_chain_length = 0;
     for (chainNode *temp = head; temp != NULL; temp = temp->next)
@@ -250,16 +701,16 @@ void mems_print_stats()
         size_t subchain_length = 0;
 
         int d = temp->v_ptr_start;
-        for (subChainNode *subTemp = temp->subChainHead; subTemp != NULL; subTemp = subTemp->next)
+        for (size_t i = 0; i < temp->sub_count; i++)
         {
-            if (subTemp->type == 0)
+            if (temp->sub_type[i] == 0)
             {
-                printf("P[%lu:%lu] <-> ", d + subTemp->v_ptr_start_index, d + subTemp->v_ptr_start_index + subTemp->chunk_size - 1);
+                printf("P[%lu:%lu] <-> ", d + temp->sub_offset[i], d + temp->sub_offset[i] + temp->sub_size[i] - 1);
             }
             else
             {
-                printf("H[%lu:%lu] <-> ", d + subTemp->v_ptr_start_index, d + subTemp->v_ptr_start_index + subTemp->chunk_size - 1);
-                space_unused += subTemp->chunk_size;
+                printf("H[%lu:%lu] <-> ", d + temp->sub_offset[i], d + temp->sub_offset[i] + temp->sub_size[i] - 1);
+                space_unused += temp->sub_size[i];
             }
             subchain_length++;
         }
@@ -282,6 +733,7 @@ void mems_print_stats()
     printf("-----------------------------\n");
 
     deallocate_memory_munmap(subchain_length_array, sizeof(size_t) * main_chain_length);
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
@@ -300,31 +752,28 @@ void *mems_get(void *v_ptr)
     }
 }
 
-void fragment_memory(subChainNode *head)
+/*
+Runs the heap maintenance that mems_free skips when defer_free is set:
+1. applies the frees waiting in the deferred queue
+2. merges adjacent holes and rebuilds the largest hole hint of every node that changed
+3. releases the whole pages inside those holes to the OS
+Called by the maintenance thread, or directly by applications that drive it from their own loop.
+Input Parameter: Nothing
+Returns: Nothing
+*/
+void mems_maintain()
 {
-    subChainNode *temp = head;
-    while (temp != NULL)
+    pthread_mutex_lock(&heap_lock);
+    drain_deferred_frees();
+    for (chainNode *temp = head; temp != NULL; temp = temp->next)
     {
-        if (temp->type == 1)
+        if (temp->dirty)
         {
-            if (temp->prev != NULL && temp->prev->type == 1)
-            {
-                temp->prev->chunk_size = temp->prev->chunk_size + temp->chunk_size;
-                temp->prev->next = temp->next;
-                if (temp->next != NULL)
-                {
-                    temp->next->prev = temp->prev;
-                }
-                subChainNode *to_delete = temp;
-                temp = temp->prev;
-
-                to_delete->next = NULL;
-                to_delete->prev = NULL;
-                deallocate_memory_munmap(to_delete, sizeof(subChainNode));
-            }
+            purge_holes(temp);
+            temp->dirty = 0;
         }
-        temp = temp->next;
     }
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*
@@ -334,23 +783,12 @@ Returns: nothing
 */
 void mems_free(void *v_ptr)
 {
-    for (chainNode *temp = head; temp != NULL; temp = temp->next)
+    if (deferred_queue != NULL && push_deferred_free(v_ptr))
     {
-        if (temp->v_ptr <= v_ptr && v_ptr < temp->v_ptr + temp->seg_size)
-        {
-            size_t index = (size_t)v_ptr - (size_t)temp->v_ptr;
-            subChainNode *subTemp = temp->subChainHead;
-            while (subTemp != NULL)
-            {
-                if (subTemp->v_ptr_start_index == index)
-                {
-                    subTemp->type = 1;
-                    fragment_memory(temp->subChainHead);
-                    break;
-                }
-                subTemp = subTemp->next;
-            }
-            break;
-        }
+        return;
     }
-}
\ No newline at end of file
+
+    pthread_mutex_lock(&heap_lock);
+    release_segment(v_ptr, 1);
+    pthread_mutex_unlock(&heap_lock);
+}